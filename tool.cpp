@@ -13,6 +13,11 @@
 #include <sstream>
 #include <iomanip>
 #include <ctime>
+#include <cmath>
+#include <algorithm>
+#include <set>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
 //#include <boost/foreach.hpp>
 #include <boost/foreach.hpp> //boost foreach is not accessible in the current MW Pack
 #include <apd/commonutils/OtfVarRetriever.hpp>
@@ -27,6 +32,33 @@ namespace APD {
 
 std::string const UcLogReport::EMPTY_FIELD = "";
 std::string const UcLogReport::ROOM_PARSER_STATS = "RoomParser";
+std::string const UcLogReport::HEAVY_HITTERS_STATS = "HeavyHitters";
+std::string const UcLogReport::TAIL_SUMMARY = "Summary";
+std::string const UcLogReport::PROPERTY_LIST = "PropertyList";
+
+// 64-bit FNV-1a
+static uint64_t hashKey(std::string const& iKey)
+{
+    uint64_t aHash = 14695981039346656037ULL;
+    for (std::string::const_iterator it = iKey.begin(); it != iKey.end(); ++it) {
+        aHash ^= static_cast<unsigned char>(*it);
+        aHash *= 1099511628211ULL;
+    }
+    return aHash;
+}
+
+static uint32_t getOtfVarUnsigned(std::string const& iOtfVarName, uint32_t iDefault)
+{
+    const KIT::FldString aValueStr = OtfVarRetriever::getOTFVar(iOtfVarName);
+    if (aValueStr.isValid()) {
+        uint32_t aValue = 0;
+        std::istringstream aValueSS(aValueStr.get());
+        if ((aValueSS >> aValue) && aValue > 0) {
+            return aValue;
+        }
+    }
+    return iDefault;
+}
 
 // ////////////////////////////////////////////////////////////////////////////
 //constructor of class UcLogReport
@@ -50,6 +82,7 @@ UcLogReport::UcLogReport( BomAvailPricingRs  const* const iResponse
     if (iResponse) {
         log(*iResponse, iRequest, EMPTY_FIELD, iRequestedRates, false);
         logRoomParserStats(*iResponse, false);
+        recordHeavyHitters(*iResponse);
     }
     else {
       APD_LOG_INFO("APD_REPORT ==> Error: response is NULL");
@@ -73,6 +106,7 @@ UcLogReport::UcLogReport( BomAvailPricingRs  const* const iResponse
     if (iResponse) {
         log(*iResponse, iRequest, getProvidersFromRequest(iRequest), getRatesFromRequest(iRequest), iMultiSingle);
         logRoomParserStats(*iResponse, iMultiSingle);
+        recordHeavyHitters(*iResponse);
     }
     else {
       APD_LOG_INFO("APD_REPORT ==> Error: response is NULL");
@@ -82,6 +116,12 @@ UcLogReport::UcLogReport( BomAvailPricingRs  const* const iResponse
 // If log changes:
 // Increase LOG_VERSION
 // Update wiki: http://hdpdoc/doku.php?id=teams:hda:projects:search_engine:reporting#apd_logs
+//
+// Requested properties field of the criteria block:
+// - plain list of IDs, in request order: RTLON001,RTPAR001
+// - with HOS_APD_LOG_REPORT_PROPERTY_LIST_ENCODING, starts with a marker:
+//   - '~': front-coded sorted unique IDs, see encodePropertyList()
+//   - '#': #<count>#<digest>, resolved by a PropertyList record
 uint32_t const UcLogReport::LOG_VERSION = 1;
 // ////////////////////////////////////////////////////////////////////////////
 void UcLogReport::log(BomAvailPricingRs const& iResponse, BomAvailPricingRq const* const iRequest, std::string const& iProviders,
@@ -94,6 +134,13 @@ void UcLogReport::log(BomAvailPricingRs const& iResponse, BomAvailPricingRq cons
     // SECTION_START is |, I guess, FIELD_SEPARATOR is |
         try {
             std::vector<BomPropertyStay*> const theProperties = iResponse.getCandidateProperties();
+
+            static const std::string kOtfVarTailModeName = "HOS_APD_LOG_REPORT_TAIL_MODE";
+            if (OtfVarRetriever::getOTFVarBool(kOtfVarTailModeName, false) &&
+                !logTailSummary(iResponse, theProperties, iMultiSingle)) {
+                return;
+            }
+
             theReport << LOG_VERSION << SECTION_START;
             if (iMultiSingle) theReport << "MultiSingle";
             else theReport << getFunctionality(&iResponse);
@@ -158,6 +205,238 @@ void UcLogReport::log(BomAvailPricingRs const& iResponse, BomAvailPricingRq cons
 }
 
 
+// ////////////////////////////////////////////////////////////////////////////
+// Tail mode
+// ////////////////////////////////////////////////////////////////////////////
+// Log-scale response time histogram: bucket 0 is below 1ms, bucket i covers
+// [1ms * 1.25^(i-1), 1ms * 1.25^i). Counters are halved once kMaxSamples is
+// reached so that the percentiles follow the recent traffic.
+class LatencyHistogram
+{
+public:
+
+    static const uint32_t kNbBuckets = 64;
+    static const uint32_t kMinSamples = 100;
+    static const uint32_t kMaxSamples = 100000;
+
+    LatencyHistogram() {
+        reset();
+    }
+
+    void reset() {
+        std::fill(_buckets, _buckets + kNbBuckets, 0);
+        _total = 0;
+    }
+
+    void add(double iResponseTime) {
+        ++_buckets[getBucket(iResponseTime)];
+        ++_total;
+    }
+
+    void merge(LatencyHistogram const& iOther) {
+        for (uint32_t i = 0; i < kNbBuckets; ++i) {
+            _buckets[i] += iOther._buckets[i];
+        }
+        _total += iOther._total;
+
+        while (_total >= kMaxSamples) {
+            _total = 0;
+            for (uint32_t i = 0; i < kNbBuckets; ++i) {
+                _buckets[i] /= 2;
+                _total += _buckets[i];
+            }
+        }
+    }
+
+    // Upper bound of the bucket holding the given percentile, negative while
+    // there are not enough samples
+    double getPercentile(uint32_t iPercent) const {
+        if (_total < kMinSamples) {
+            return -1.0;
+        }
+        const uint64_t aRank = (static_cast<uint64_t>(_total) * iPercent + 99) / 100;
+        uint64_t aCumulated = 0;
+        for (uint32_t i = 0; i < kNbBuckets; ++i) {
+            aCumulated += _buckets[i];
+            if (aCumulated >= aRank) {
+                return getUpperBound(i);
+            }
+        }
+        return getUpperBound(kNbBuckets - 1);
+    }
+
+private:
+
+    static uint32_t getBucket(double iResponseTime) {
+        if (iResponseTime < 0.001) {
+            return 0;
+        }
+        const double aBucket = 1.0 + std::floor(std::log(iResponseTime / 0.001) / std::log(1.25));
+        return aBucket >= kNbBuckets - 1 ? kNbBuckets - 1 : static_cast<uint32_t>(aBucket);
+    }
+
+    static double getUpperBound(uint32_t iBucket) {
+        return 0.001 * std::pow(1.25, static_cast<double>(iBucket));
+    }
+
+    uint32_t _buckets[kNbBuckets];
+    uint32_t _total;
+};
+
+// One histogram per functionality. Each thread records into its own
+// histograms, which are merged into the shared ones every
+// HOS_APD_LOG_REPORT_TAIL_MERGE transactions or
+// HOS_APD_LOG_REPORT_TAIL_MERGE_SECONDS seconds, whichever comes first.
+// Thresholds are read without locking from the thread copy of the shared
+// histograms taken at the last merge, with the percentiles of
+// HOS_APD_LOG_REPORT_TAIL_PERCENTILE_<functionality> (default 99) also read
+// at that time.
+class LatencyHistograms
+{
+public:
+
+    enum Functionality { kPricing = 0, kSingleAvail, kMultiAvail, kMultiSingle, kOther, kNbFunctionalities };
+
+    // Returns the current threshold of iFunctionality, then records iResponseTime
+    static double getThresholdAndAdd(Functionality iFunctionality, double iResponseTime) {
+        ThreadHistograms& aLocal = getThreadHistograms();
+        const double aThreshold = aLocal._snapshots[iFunctionality].getPercentile(aLocal._percents[iFunctionality]);
+        aLocal._pending[iFunctionality].add(iResponseTime);
+
+        const time_t aNow = std::time(0);
+        if (++aLocal._nbTransactions >= aLocal._mergeInterval || aNow - aLocal._lastMerge >= static_cast<time_t>(aLocal._mergeSeconds)) {
+            static const std::string kOtfVarMergeName = "HOS_APD_LOG_REPORT_TAIL_MERGE";
+            static const std::string kOtfVarMergeSecondsName = "HOS_APD_LOG_REPORT_TAIL_MERGE_SECONDS";
+            aLocal._mergeInterval = getOtfVarUnsigned(kOtfVarMergeName, 100);
+            aLocal._mergeSeconds = getOtfVarUnsigned(kOtfVarMergeSecondsName, 10);
+
+            static const std::string kOtfVarPercentilePrefix = "HOS_APD_LOG_REPORT_TAIL_PERCENTILE_";
+            static const std::string kNames[kNbFunctionalities] = { "Pricing", "SingleAvail", "MultiAvail", "MultiSingle", "Unknown" };
+            for (uint32_t i = 0; i < kNbFunctionalities; ++i) {
+                aLocal._percents[i] = std::min(getOtfVarUnsigned(kOtfVarPercentilePrefix + kNames[i], 99), 100u);
+            }
+
+            static LatencyHistogram sSharedHistograms[kNbFunctionalities];
+            static boost::mutex sMutex;
+
+            boost::mutex::scoped_lock aLock(sMutex);
+            for (uint32_t i = 0; i < kNbFunctionalities; ++i) {
+                sSharedHistograms[i].merge(aLocal._pending[i]);
+                aLocal._pending[i].reset();
+                aLocal._snapshots[i] = sSharedHistograms[i];
+            }
+            aLocal._nbTransactions = 0;
+            aLocal._lastMerge = aNow;
+        }
+        return aThreshold;
+    }
+
+private:
+
+    class ThreadHistograms
+    {
+    public:
+        ThreadHistograms() : _nbTransactions(0), _lastMerge(std::time(0)), _mergeInterval(100), _mergeSeconds(10) {
+            std::fill(_percents, _percents + kNbFunctionalities, 99);
+        }
+
+        LatencyHistogram _pending[kNbFunctionalities];
+        LatencyHistogram _snapshots[kNbFunctionalities];
+        uint32_t         _percents[kNbFunctionalities];
+        uint32_t         _nbTransactions;
+        time_t           _lastMerge;
+        uint32_t         _mergeInterval;
+        uint32_t         _mergeSeconds;
+    };
+
+    static ThreadHistograms& getThreadHistograms() {
+        static boost::thread_specific_ptr<ThreadHistograms> sThreadHistograms;
+        if (!sThreadHistograms.get()) {
+            sThreadHistograms.reset(new ThreadHistograms());
+        }
+        return *sThreadHistograms;
+    }
+};
+
+// Writes the fixed-size summary record of the transaction.
+// Returns true when the detailed report is required as well, i.e. when the
+// response time is above the percentile of its functionality (see
+// LatencyHistograms), when the response has no rated room stay at all or when
+// some properties have an unknown origin. Properties without availability are
+// normal in list searches: they are only counted.
+bool UcLogReport::logTailSummary(BomAvailPricingRs const& iResponse,
+                                 std::vector<BomPropertyStay*> const& iProperties, bool iMultiSingle)
+{
+    static const std::string kMultiSingle = "MultiSingle";
+    static const std::string kUnknownOrigin = formatOrigin(kUnknownSource);
+    static const std::string kY = "Y";
+    static const std::string kN = "N";
+
+    uint32_t aNbRoomStays = 0;
+    uint32_t aNbEmptyRoomStays = 0;
+    uint32_t aNbPropertiesWithoutRoomStays = 0;
+    uint32_t aNbUnknownOrigins = 0;
+
+    BOOST_FOREACH(const BomPropertyStay* aProperty, iProperties)
+    {
+        if (aProperty) {
+            std::string const aOrigin = (aProperty->getSource() != kUnknownSource) ? getOrigin(aProperty):getOrigin(&iResponse);
+            if (aOrigin.empty() || aOrigin == kUnknownOrigin) {
+                ++aNbUnknownOrigins;
+            }
+
+            std::vector<BomRoomStay*> const aVectorBomRoomStay = aProperty->getRoomStays();
+            aNbRoomStays += aVectorBomRoomStay.size();
+            if (aVectorBomRoomStay.empty()) {
+                ++aNbPropertiesWithoutRoomStays;
+            }
+            BOOST_FOREACH(const BomRoomStay* aRoomStay, aVectorBomRoomStay )
+            {
+                if (!aRoomStay || aRoomStay->getRoomRates().empty()) {
+                    ++aNbEmptyRoomStays;
+                }
+            }
+        }
+    }
+
+    std::string const aFunctionality = iMultiSingle ? kMultiSingle : getFunctionality(&iResponse);
+
+    TransactionTypeT const aTransaction = iResponse.getTransaction();
+    LatencyHistograms::Functionality const aHistogram =
+            iMultiSingle                                         ? LatencyHistograms::kMultiSingle :
+            aTransaction == BomCriAvailPricingRs::kPricing     ? LatencyHistograms::kPricing     :
+            aTransaction == BomCriAvailPricingRs::kSingleAvail ? LatencyHistograms::kSingleAvail :
+            aTransaction == BomCriAvailPricingRs::kMultiAvail  ? LatencyHistograms::kMultiAvail  :
+                                                                  LatencyHistograms::kOther;
+    const double aThreshold = LatencyHistograms::getThresholdAndAdd(aHistogram, _responseTime);
+
+    const bool aMissingRates = iProperties.empty() || aNbRoomStays == aNbEmptyRoomStays;
+    const bool aDetailed = aThreshold < 0 || _responseTime > aThreshold ||
+                           aMissingRates || aNbUnknownOrigins > 0;
+
+    std::stringstream aSummary;
+    aSummary << LOG_VERSION << SECTION_START;
+    aSummary << TAIL_SUMMARY << FIELD_SEPARATOR;
+    aSummary << aFunctionality << getCrawlingSamplingSuffix() << FIELD_SEPARATOR
+             << generateTransactionDate()                     << FIELD_SEPARATOR
+             << _responseTime                                 << FIELD_SEPARATOR
+             << _channel                                      << FIELD_SEPARATOR
+             << _officeId                                     << FIELD_SEPARATOR
+             << iProperties.size()                            << FIELD_SEPARATOR
+             << aNbRoomStays                                  << FIELD_SEPARATOR
+             << aNbPropertiesWithoutRoomStays                 << FIELD_SEPARATOR
+             << aNbEmptyRoomStays                             << FIELD_SEPARATOR
+             << aNbUnknownOrigins                             << FIELD_SEPARATOR
+             << (aDetailed ? kY : kN)
+             ;
+
+    HDP_LOG_REPORT(aSummary.str());
+    HDP_LOG_DEBUG(aSummary.str());
+
+    return aDetailed;
+}
+
+
 class ChainStats
 {
 public:
@@ -270,6 +549,330 @@ void UcLogReport::logRoomParserStats(BomAvailPricingRs const& iResponse, bool iM
 
 
 
+// ////////////////////////////////////////////////////////////////////////////
+// Heavy hitters
+// ////////////////////////////////////////////////////////////////////////////
+// Fixed-memory streaming sketch: a count-min of the number of occurrences and
+// of the cumulated response time per key, plus a top-K min-heap per weighting.
+class HeavyHitterSketch
+{
+public:
+
+    static const uint32_t kDepth = 4;
+    static const uint32_t kWidth = 1024;
+    static const size_t   kTopK  = 10;
+
+    class Entry
+    {
+    public:
+        Entry(std::string const& iKey, double iWeight) : _key(iKey), _weight(iWeight) {}
+
+        std::string _key;
+        double      _weight;
+    };
+
+    HeavyHitterSketch() {
+        reset();
+    }
+
+    void reset() {
+        std::fill(&_counts[0][0], &_counts[0][0] + kDepth * kWidth, 0.0);
+        std::fill(&_responseTimes[0][0], &_responseTimes[0][0] + kDepth * kWidth, 0.0);
+        _topByCount.clear();
+        _topByResponseTime.clear();
+    }
+
+    void add(std::string const& iKey, double iResponseTime) {
+        if (iKey.empty()) {
+            return;
+        }
+        const uint64_t aHash = hashKey(iKey);
+        for (uint32_t aRow = 0; aRow < kDepth; ++aRow) {
+            const uint32_t aCell = getCell(aHash, aRow);
+            _counts[aRow][aCell] += 1.0;
+            _responseTimes[aRow][aCell] += iResponseTime;
+        }
+        offer(iKey, aHash);
+    }
+
+    void merge(HeavyHitterSketch const& iOther) {
+        for (uint32_t aRow = 0; aRow < kDepth; ++aRow) {
+            for (uint32_t aCell = 0; aCell < kWidth; ++aCell) {
+                _counts[aRow][aCell] += iOther._counts[aRow][aCell];
+                _responseTimes[aRow][aCell] += iOther._responseTimes[aRow][aCell];
+            }
+        }
+
+        // Candidates of both sides are re-ranked against the merged counters
+        std::set<std::string> aCandidates;
+        BOOST_FOREACH(const Entry& aEntry, _topByCount)               aCandidates.insert(aEntry._key);
+        BOOST_FOREACH(const Entry& aEntry, _topByResponseTime)        aCandidates.insert(aEntry._key);
+        BOOST_FOREACH(const Entry& aEntry, iOther._topByCount)        aCandidates.insert(aEntry._key);
+        BOOST_FOREACH(const Entry& aEntry, iOther._topByResponseTime) aCandidates.insert(aEntry._key);
+
+        _topByCount.clear();
+        _topByResponseTime.clear();
+        BOOST_FOREACH(const std::string& aKey, aCandidates) {
+            offer(aKey, hashKey(aKey));
+        }
+    }
+
+    // Halves every counter, so that the sketch reflects the recent traffic
+    void decay() {
+        for (uint32_t aRow = 0; aRow < kDepth; ++aRow) {
+            for (uint32_t aCell = 0; aCell < kWidth; ++aCell) {
+                _counts[aRow][aCell] *= 0.5;
+                _responseTimes[aRow][aCell] *= 0.5;
+            }
+        }
+        BOOST_FOREACH(Entry& aEntry, _topByCount)        aEntry._weight *= 0.5;
+        BOOST_FOREACH(Entry& aEntry, _topByResponseTime) aEntry._weight *= 0.5;
+    }
+
+    // Heaviest first
+    std::vector<Entry> getTop(bool iByResponseTime) const {
+        std::vector<Entry> aTop = iByResponseTime ? _topByResponseTime : _topByCount;
+        std::sort(aTop.begin(), aTop.end(), isHeavier);
+        return aTop;
+    }
+
+private:
+
+    static bool isHeavier(Entry const& iLeft, Entry const& iRight) {
+        return iLeft._weight > iRight._weight;
+    }
+
+    static uint32_t getCell(uint64_t iHash, uint32_t iRow) {
+        const uint32_t aHash1 = static_cast<uint32_t>(iHash);
+        const uint32_t aHash2 = static_cast<uint32_t>(iHash >> 32) | 1;
+        return (aHash1 + iRow * aHash2) % kWidth;
+    }
+
+    static double estimate(double const (&iTable)[kDepth][kWidth], uint64_t iHash) {
+        double aEstimate = iTable[0][getCell(iHash, 0)];
+        for (uint32_t aRow = 1; aRow < kDepth; ++aRow) {
+            aEstimate = std::min(aEstimate, iTable[aRow][getCell(iHash, aRow)]);
+        }
+        return aEstimate;
+    }
+
+    void offer(std::string const& iKey, uint64_t iHash) {
+        offer(_topByCount, iKey, estimate(_counts, iHash));
+        offer(_topByResponseTime, iKey, estimate(_responseTimes, iHash));
+    }
+
+    // ioHeap is a min-heap: its front is the lightest of the current top-K
+    static void offer(std::vector<Entry>& ioHeap, std::string const& iKey, double iWeight) {
+        for (std::vector<Entry>::iterator it = ioHeap.begin(); it != ioHeap.end(); ++it) {
+            if (it->_key == iKey) {
+                it->_weight = iWeight;
+                std::make_heap(ioHeap.begin(), ioHeap.end(), isHeavier);
+                return;
+            }
+        }
+        if (ioHeap.size() < kTopK) {
+            ioHeap.push_back(Entry(iKey, iWeight));
+            std::push_heap(ioHeap.begin(), ioHeap.end(), isHeavier);
+        }
+        else if (iWeight > ioHeap.front()._weight) {
+            std::pop_heap(ioHeap.begin(), ioHeap.end(), isHeavier);
+            ioHeap.back() = Entry(iKey, iWeight);
+            std::push_heap(ioHeap.begin(), ioHeap.end(), isHeavier);
+        }
+    }
+
+    double _counts[kDepth][kWidth];
+    double _responseTimes[kDepth][kWidth];
+    std::vector<Entry> _topByCount;
+    std::vector<Entry> _topByResponseTime;
+};
+
+// Each thread feeds its own sketches, which are merged into the shared ones
+// every HOS_APD_LOG_REPORT_HEAVY_HITTERS_MERGE transactions or
+// HOS_APD_LOG_REPORT_HEAVY_HITTERS_MERGE_SECONDS seconds, whichever comes
+// first. Queries only see what has been merged so far. A thread sketch is
+// decayed as many times as the shared ones were since its last merge, so
+// counts held by an idle thread are not merged back at full weight.
+class HeavyHitters
+{
+public:
+
+    enum Dimension { kOffice = 0, kAtid, kProperty, kChain, kNbDimensions };
+
+    static std::string const& getDimensionName(uint32_t iDimension) {
+        static const std::string kNames[kNbDimensions] = { "Office", "Atid", "Property", "Chain" };
+        return kNames[iDimension];
+    }
+
+    static void add(Dimension iDimension, std::string const& iKey, double iResponseTime) {
+        getThreadSketches()._sketches[iDimension].add(iKey, iResponseTime);
+    }
+
+    // Returns true when the shared sketches are due for a stats dump
+    static bool endTransaction(uint32_t iMergeInterval, uint32_t iMergeSeconds, uint32_t iDumpInterval) {
+        ThreadSketches& aLocal = getThreadSketches();
+        const time_t aNow = std::time(0);
+        if (++aLocal._nbTransactions < iMergeInterval && aNow - aLocal._lastMerge < static_cast<time_t>(iMergeSeconds)) {
+            return false;
+        }
+
+        boost::mutex::scoped_lock aLock(getMutex());
+        // Beyond 64 halvings nothing significant is left
+        const uint32_t aNbDecays = std::min(getDecayEpoch() - aLocal._decayEpoch, 64u);
+        for (uint32_t aDimension = 0; aDimension < kNbDimensions; ++aDimension) {
+            for (uint32_t i = 0; i < aNbDecays; ++i) {
+                aLocal._sketches[aDimension].decay();
+            }
+            getSharedSketches()[aDimension].merge(aLocal._sketches[aDimension]);
+            aLocal._sketches[aDimension].reset();
+        }
+        aLocal._nbTransactions = 0;
+        aLocal._lastMerge = aNow;
+        aLocal._decayEpoch = getDecayEpoch();
+
+        static uint32_t sNbMerges = 0;
+        return (++sNbMerges % iDumpInterval) == 0;
+    }
+
+    static void decay() {
+        boost::mutex::scoped_lock aLock(getMutex());
+        for (uint32_t aDimension = 0; aDimension < kNbDimensions; ++aDimension) {
+            getSharedSketches()[aDimension].decay();
+        }
+        ++getDecayEpoch();
+    }
+
+    static std::vector<HeavyHitterSketch::Entry> getTop(uint32_t iDimension, bool iByResponseTime) {
+        boost::mutex::scoped_lock aLock(getMutex());
+        return getSharedSketches()[iDimension].getTop(iByResponseTime);
+    }
+
+private:
+
+    class ThreadSketches
+    {
+    public:
+        ThreadSketches() : _nbTransactions(0), _lastMerge(std::time(0)), _decayEpoch(0) {}
+
+        HeavyHitterSketch _sketches[kNbDimensions];
+        uint32_t          _nbTransactions;
+        time_t            _lastMerge;
+        uint32_t          _decayEpoch;
+    };
+
+    static ThreadSketches& getThreadSketches() {
+        static boost::thread_specific_ptr<ThreadSketches> sThreadSketches;
+        if (!sThreadSketches.get()) {
+            sThreadSketches.reset(new ThreadSketches());
+            boost::mutex::scoped_lock aLock(getMutex());
+            sThreadSketches->_decayEpoch = getDecayEpoch();
+        }
+        return *sThreadSketches;
+    }
+
+    static HeavyHitterSketch* getSharedSketches() {
+        static HeavyHitterSketch sSharedSketches[kNbDimensions];
+        return sSharedSketches;
+    }
+
+    static boost::mutex& getMutex() {
+        static boost::mutex sMutex;
+        return sMutex;
+    }
+
+    // Number of decays of the shared sketches, guarded by getMutex()
+    static uint32_t& getDecayEpoch() {
+        static uint32_t sDecayEpoch = 0;
+        return sDecayEpoch;
+    }
+};
+
+// Feeds the office, ATID, property and chain sketches, weighted by count and
+// by response time. Properties and chains are counted once per candidate property.
+void UcLogReport::recordHeavyHitters(BomAvailPricingRs const& iResponse)
+{
+    static const std::string kOtfVarName = "HOS_APD_LOG_REPORT_HEAVY_HITTERS";
+    static const std::string kOtfVarMergeName = "HOS_APD_LOG_REPORT_HEAVY_HITTERS_MERGE";
+    static const std::string kOtfVarMergeSecondsName = "HOS_APD_LOG_REPORT_HEAVY_HITTERS_MERGE_SECONDS";
+    static const std::string kOtfVarDumpName = "HOS_APD_LOG_REPORT_HEAVY_HITTERS_DUMP";
+
+    if (!OtfVarRetriever::getOTFVarBool(kOtfVarName, false)) {
+        return;
+    }
+
+    try {
+        HeavyHitters::add(HeavyHitters::kOffice, _officeId, _responseTime);
+        HeavyHitters::add(HeavyHitters::kAtid, _atid, _responseTime);
+
+        std::vector<BomPropertyStay*> const theProperties = iResponse.getCandidateProperties();
+        BOOST_FOREACH(const BomPropertyStay* aProperty, theProperties)
+        {
+            if (aProperty) {
+                HeavyHitters::add(HeavyHitters::kProperty, getPropertyId(aProperty), _responseTime);
+                HeavyHitters::add(HeavyHitters::kChain, getChainCode(aProperty), _responseTime);
+            }
+        }
+
+        if (HeavyHitters::endTransaction(getOtfVarUnsigned(kOtfVarMergeName, 100),
+                                         getOtfVarUnsigned(kOtfVarMergeSecondsName, 10),
+                                         getOtfVarUnsigned(kOtfVarDumpName, 10))) {
+            logHeavyHitterStats();
+            HeavyHitters::decay();
+        }
+    } APD_CATCH_DO_NOTHING;
+}
+
+// Static: also callable without a UcLogReport instance
+void UcLogReport::logHeavyHitterStats()
+{
+    APD_LOG_INFO("APD_REPORT - logHeavyHitterStats()");
+    try {
+        static const std::string kByCount = "Count";
+        static const std::string kByResponseTime = "ResponseTime";
+
+        for (uint32_t aDimension = 0; aDimension < HeavyHitters::kNbDimensions; ++aDimension) {
+            for (uint32_t aWeighting = 0; aWeighting < 2; ++aWeighting) {
+                const bool aByResponseTime = (aWeighting == 1);
+                std::vector<HeavyHitterSketch::Entry> const aTop = HeavyHitters::getTop(aDimension, aByResponseTime);
+                if (aTop.empty()) {
+                    continue;
+                }
+
+                std::stringstream aReport;
+                aReport << LOG_VERSION << SECTION_START;
+                aReport << HEAVY_HITTERS_STATS << FIELD_SEPARATOR;
+                aReport << HeavyHitters::getDimensionName(aDimension) << FIELD_SEPARATOR;
+                aReport << (aByResponseTime ? kByResponseTime : kByCount);
+
+                BOOST_FOREACH(const HeavyHitterSketch::Entry& aEntry, aTop) {
+                    aReport << SECTION_START   << aEntry._key
+                            << FIELD_SEPARATOR << aEntry._weight;
+                }
+
+                HDP_LOG_STATS_REPORT(aReport.str());
+                HDP_LOG_DEBUG(aReport.str());
+            }
+        }
+    } APD_CATCH_DO_NOTHING;
+}
+
+// Static: queryable in-process without a UcLogReport instance.
+// iDimension is one of "Office", "Atid", "Property", "Chain"; heaviest first
+std::vector<std::pair<std::string, double> > UcLogReport::getHeavyHitters(std::string const& iDimension,
+                                                                         bool iByResponseTime)
+{
+    std::vector<std::pair<std::string, double> > aResult;
+    for (uint32_t aDimension = 0; aDimension < HeavyHitters::kNbDimensions; ++aDimension) {
+        if (HeavyHitters::getDimensionName(aDimension) == iDimension) {
+            BOOST_FOREACH(const HeavyHitterSketch::Entry& aEntry, HeavyHitters::getTop(aDimension, iByResponseTime)) {
+                aResult.push_back(std::make_pair(aEntry._key, aEntry._weight));
+            }
+        }
+    }
+    return aResult;
+}
+
+
 // ////////////////////////////////////////////////////////////////////////////
 // Response Time
 // ////////////////////////////////////////////////////////////////////////////
@@ -388,19 +991,19 @@ std::string UcLogReport::getCitiesFromRequest(BomAvailPricingRq const* const iRe
 
 std::string UcLogReport::getPropertiesFromRequest(BomAvailPricingRq const* const iRequest)
 {
-    std::stringstream aPropertiesSS;
+    std::vector<std::string> aPropertyIds;
 
     if(iRequest->getPropertyProduct() &&
        iRequest->getPropertyProduct()->getPropertyId() &&
        iRequest->getPropertyProduct()->getPropertyId()->isValid()) {
 
-        aPropertiesSS << FIELD_VALUE_SEPARATOR << iRequest->getPropertyProduct()->getPropertyId()->get();
+        aPropertyIds.push_back(iRequest->getPropertyProduct()->getPropertyId()->get());
     }
 
     if(iRequest->getPredefinedPropertyList() && !iRequest->getPredefinedPropertyList()->getPropertyProducts().empty()) {
         BOOST_FOREACH(const BomPropertyProduct* aProperty, iRequest->getPredefinedPropertyList()->getPropertyProducts()) {
             if(aProperty && aProperty->getPropertyId() && aProperty->getPropertyId()->isValid()) {
-                aPropertiesSS << FIELD_VALUE_SEPARATOR << aProperty->getPropertyId()->get();
+                aPropertyIds.push_back(aProperty->getPropertyId()->get());
             }
         }
     }
@@ -408,17 +1011,141 @@ std::string UcLogReport::getPropertiesFromRequest(BomAvailPricingRq const* const
     if(iRequest->getPreferredPropertyList() && !iRequest->getPreferredPropertyList()->getPropertyProducts().empty()) {
         BOOST_FOREACH(const BomPropertyProduct* aProperty, iRequest->getPreferredPropertyList()->getPropertyProducts()) {
             if(aProperty && aProperty->getPropertyId() && aProperty->getPropertyId()->isValid()) {
-                aPropertiesSS << FIELD_VALUE_SEPARATOR << aProperty->getPropertyId()->get();
+                aPropertyIds.push_back(aProperty->getPropertyId()->get());
             }
         }
     }
 
-    const std::string aPropertiesStr = aPropertiesSS.str();
-    if (!aPropertiesStr.empty()) {
-        return aPropertiesStr.substr(1);
+    if (aPropertyIds.empty()) {
+        return EMPTY_FIELD;
     }
 
-    return EMPTY_FIELD;
+    static const std::string kOtfVarName = "HOS_APD_LOG_REPORT_PROPERTY_LIST_ENCODING";
+    if (OtfVarRetriever::getOTFVarBool(kOtfVarName, false)) {
+        return encodePropertyList(aPropertyIds);
+    }
+
+    std::stringstream aPropertiesSS;
+    BOOST_FOREACH(const std::string& aPropertyId, aPropertyIds) {
+        aPropertiesSS << FIELD_VALUE_SEPARATOR << aPropertyId;
+    }
+    return aPropertiesSS.str().substr(1);
+}
+
+// Digests of the property lists written in a PropertyList record during the
+// current period of HOS_APD_LOG_REPORT_PROPERTY_LIST_PERIOD seconds (default
+// 3600). The set is cleared at each new period, and when full, so every list
+// in use is written again at least once per period. A digest can therefore be
+// resolved from the records of the last period: after a log rotation, the
+// first period of the new file may refer to records of the previous file.
+class PropertyListDigests
+{
+public:
+
+    static const size_t kMaxDigests = 100000;
+
+    static boost::mutex& getMutex() {
+        static boost::mutex sMutex;
+        return sMutex;
+    }
+
+    // Both must be called under getMutex()
+    static bool contains(uint64_t iDigest, uint32_t iPeriodSeconds) {
+        const time_t aNow = std::time(0);
+        if (getDigests().size() >= kMaxDigests || aNow - getPeriodStart() >= static_cast<time_t>(iPeriodSeconds)) {
+            getDigests().clear();
+            getPeriodStart() = aNow;
+        }
+        return getDigests().count(iDigest) > 0;
+    }
+
+    static void insert(uint64_t iDigest) {
+        getDigests().insert(iDigest);
+    }
+
+private:
+
+    static std::set<uint64_t>& getDigests() {
+        static std::set<uint64_t> sDigests;
+        return sDigests;
+    }
+
+    static time_t& getPeriodStart() {
+        static time_t sPeriodStart = std::time(0);
+        return sPeriodStart;
+    }
+};
+
+// Static, as getPropertiesFromRequest().
+// Dedupes and sorts ioPropertyIds, then encodes them:
+// - up to HOS_APD_LOG_REPORT_PROPERTY_LIST_DIGEST_THRESHOLD IDs (default 100),
+//   as a front-coded list marked by a leading '~': the first ID in full, then
+//   for each ID the length of the prefix shared with the previous one, '~'
+//   and the rest, e.g. ~RTLON001,2~PAR001,7~2
+// - above, as #<count>#<64-bit digest>. The full list is written in a
+//   PropertyList record, once per distinct digest and period (see
+//   PropertyListDigests), before any line referring to it.
+std::string UcLogReport::encodePropertyList(std::vector<std::string>& ioPropertyIds)
+{
+    static const std::string kOtfVarThresholdName = "HOS_APD_LOG_REPORT_PROPERTY_LIST_DIGEST_THRESHOLD";
+    static const std::string kOtfVarPeriodName = "HOS_APD_LOG_REPORT_PROPERTY_LIST_PERIOD";
+    static const char kPrefixSeparator = '~';
+    static const char kDigestSeparator = '#';
+
+    std::sort(ioPropertyIds.begin(), ioPropertyIds.end());
+    ioPropertyIds.erase(std::unique(ioPropertyIds.begin(), ioPropertyIds.end()), ioPropertyIds.end());
+
+    std::stringstream aPropertiesSS;
+    if (ioPropertyIds.size() <= getOtfVarUnsigned(kOtfVarThresholdName, 100)) {
+        std::string const* aPrevious = 0;
+        BOOST_FOREACH(const std::string& aPropertyId, ioPropertyIds) {
+            if (aPrevious) {
+                size_t aPrefix = 0;
+                while (aPrefix < aPrevious->size() && aPrefix < aPropertyId.size() &&
+                       (*aPrevious)[aPrefix] == aPropertyId[aPrefix]) {
+                    ++aPrefix;
+                }
+                aPropertiesSS << FIELD_VALUE_SEPARATOR << aPrefix << kPrefixSeparator << aPropertyId.substr(aPrefix);
+            }
+            else {
+                aPropertiesSS << kPrefixSeparator << aPropertyId;
+            }
+            aPrevious = &aPropertyId;
+        }
+        return aPropertiesSS.str();
+    }
+
+    std::stringstream aFullListSS;
+    BOOST_FOREACH(const std::string& aPropertyId, ioPropertyIds) {
+        aFullListSS << FIELD_VALUE_SEPARATOR << aPropertyId;
+    }
+    const std::string aFullList = aFullListSS.str().substr(1);
+    const uint64_t aDigest = hashKey(aFullList);
+
+    std::stringstream aDigestSS;
+    aDigestSS << std::hex << std::setfill('0') << std::setw(16) << aDigest;
+
+    {
+        // The digest is marked as written only once its record is logged, so
+        // that no thread can log a reference to it before the record itself
+        boost::mutex::scoped_lock aLock(PropertyListDigests::getMutex());
+        if (!PropertyListDigests::contains(aDigest, getOtfVarUnsigned(kOtfVarPeriodName, 3600))) {
+            std::stringstream aSideTable;
+            aSideTable << LOG_VERSION << SECTION_START;
+            aSideTable << PROPERTY_LIST << FIELD_SEPARATOR;
+            aSideTable << aDigestSS.str() << FIELD_SEPARATOR
+                       << ioPropertyIds.size() << FIELD_SEPARATOR
+                       << aFullList;
+
+            HDP_LOG_REPORT(aSideTable.str());
+            HDP_LOG_DEBUG(aSideTable.str());
+
+            PropertyListDigests::insert(aDigest);
+        }
+    }
+
+    aPropertiesSS << kDigestSeparator << ioPropertyIds.size() << kDigestSeparator << aDigestSS.str();
+    return aPropertiesSS.str();
 }
 
 std::string UcLogReport::getChainsFromRequest(BomAvailPricingRq const* const iRequest)